@@ -0,0 +1,121 @@
+// sweep every gain, sample rate, LDO level, bandgap chopper, and (if
+// installed) PGA capacitor configuration, collecting SAMPLES samples in
+// each, and print the results as CSV. hold the input constant while this
+// runs. the noise_free_bits column (floored) is suitable for feeding to
+// nau7802_set_noise_free_bits() for your board's LDO/chopper/cap setup.
+
+#include <nau7802.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+
+// adjust these for your board
+#define SDA_PIN 8
+#define SCL_PIN 9
+#define SAMPLES 256
+// highest LDO level to try; it must be at least 0.3V less than DVDD
+#define MAX_LDO NAU7802_LDO_30V
+// define this if a capacitor connects Vin2P and Vin2N
+// #define PGA_CAP_INSTALLED
+// define this to the GPIO wired to DRDY to measure the conversion clock
+// #define DRDY_PIN 10
+
+static const char* TAG = "characterize";
+
+static const unsigned gains[] = { 0, 1, 2, 4, 8, 16, 32, 64, 128 };
+static const unsigned rates[] = { 10, 20, 40, 80, 320 };
+
+static const char*
+ldo_name(int ldo){
+  static const char* names[] = {
+    "4.5", "4.2", "3.9", "3.6", "3.3", "3.0", "2.7", "2.4",
+  };
+  return ldo < 0 ? "avdd" : names[ldo];
+}
+
+// ldo < 0 selects the AVDD pin
+static int
+set_ldo(i2c_master_dev_handle_t nau, int ldo){
+  if(ldo < 0){
+    return nau7802_disable_ldo(nau);
+  }
+  return nau7802_enable_ldo(nau, ldo, false);
+}
+
+static int
+sweep(i2c_master_dev_handle_t nau, int ldo, bool chop, bool cap){
+  for(unsigned r = 0 ; r < sizeof(rates) / sizeof(*rates) ; ++r){
+    if(nau7802_set_sample_rate(nau, rates[r])){
+      return -1;
+    }
+    for(unsigned g = 0 ; g < sizeof(gains) / sizeof(*gains) ; ++g){
+      if(nau7802_set_gain(nau, gains[g])){
+        return -1;
+      }
+      nau7802_noise_stats stats;
+      if(nau7802_characterize(nau, SAMPLES, &stats)){
+        return -1;
+      }
+      printf("%s,%d,%d,%u,%u,%u,%.1f,%.3f,%ld,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+             ldo_name(ldo), chop, cap, rates[r], gains[g], stats.samples,
+             stats.mean, stats.rms_noise, stats.peak_to_peak, stats.enob,
+             stats.noise_free_bits, stats.sample_rate, stats.conversion_rate,
+             stats.bus_xfers);
+    }
+  }
+  return 0;
+}
+
+void app_main(void){
+  i2c_master_bus_config_t buscfg = {
+    .i2c_port = -1,
+    .sda_io_num = SDA_PIN,
+    .scl_io_num = SCL_PIN,
+    .clk_source = I2C_CLK_SRC_DEFAULT,
+    .glitch_ignore_cnt = 7,
+    .flags.enable_internal_pullup = true,
+  };
+  i2c_master_bus_handle_t bus;
+  esp_err_t e = i2c_new_master_bus(&buscfg, &bus);
+  if(e != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) creating I2C bus", esp_err_to_name(e));
+    return;
+  }
+  i2c_master_dev_handle_t nau;
+  if(nau7802_detect(bus, &nau) || nau7802_reset(nau) || nau7802_poweron(nau)){
+    return;
+  }
+#ifdef DRDY_PIN
+  if(nau7802_measure_clock(nau, DRDY_PIN, 100)){
+    return;
+  }
+#endif
+  printf("ldo,chop,cap,rate,gain,samples,mean,rms,p2p,enob,nfb,sps,convsps,xfers\n");
+  bool cap = false;
+#ifdef PGA_CAP_INSTALLED
+  for(unsigned c = 0 ; c < 2 ; ++c){
+    cap = c;
+#endif
+    if(nau7802_set_pga_cap(nau, cap)){
+      return;
+    }
+    for(int ldo = -1 ; ldo <= NAU7802_LDO_24V ; ++ldo){
+      if(ldo >= 0 && ldo < MAX_LDO){
+        continue;
+      }
+      if(set_ldo(nau, ldo)){
+        return;
+      }
+      for(unsigned chop = 0 ; chop < 2 ; ++chop){
+        if(nau7802_set_bandgap_chop(nau, chop)){
+          return;
+        }
+        if(sweep(nau, ldo, chop, cap)){
+          return;
+        }
+      }
+    }
+#ifdef PGA_CAP_INSTALLED
+  }
+#endif
+  ESP_LOGI(TAG, "sweep complete");
+}
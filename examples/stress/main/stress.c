@@ -0,0 +1,226 @@
+// exercise concurrent reads and configuration changes. one task cycles
+// through gain and sample rate configurations, each with a distinct number
+// of noise-free bits, while another calls nau7802_read() as fast as it can.
+// every accepted sample is checked against the truncation width of the
+// configuration in effect for the whole read, and read latency is reported
+// both without and with configuration churn. the input ought be noisy in
+// its low bits (e.g. an unloaded load cell), so that a too-narrow
+// truncation is visible statistically.
+
+#include <stdatomic.h>
+#include <nau7802.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// adjust these for your board
+#define SDA_PIN 8
+#define SCL_PIN 9
+#define QUIET_SECONDS 10
+#define CHURN_SECONDS 30
+
+static const char* TAG = "stress";
+
+typedef struct config {
+  unsigned rate;
+  unsigned gain;
+  unsigned nfb;
+} config;
+
+// the narrowest width ought be first; see check_sample()
+static const config configs[] = {
+  { 320,   1, 16, },
+  { 320, 128, 20, },
+  {  80,   1, 18, },
+  {  80, 128, 22, },
+};
+#define CONFIGCOUNT (sizeof(configs) / sizeof(*configs))
+
+static i2c_master_dev_handle_t nau;
+// our own generation, mirroring the driver's: odd while the churn task is
+// changing the configuration. cfgidx is only meaningful while it's even.
+static atomic_uint seq;
+static atomic_uint cfgidx;
+static atomic_bool done;    // tells the churn task to exit
+static atomic_bool exited;  // set by the churn task as it exits
+
+typedef struct latency {
+  unsigned count;
+  int64_t total;
+  int64_t max;
+} latency;
+
+typedef struct results {
+  latency ok;            // successful reads
+  latency notready;      // reads failing with ESP_ERR_NOT_FINISHED
+  unsigned errors;       // reads failing otherwise
+  unsigned discarded;    // successful reads overlapping a change
+  unsigned checked[CONFIGCOUNT];
+  unsigned violations[CONFIGCOUNT]; // bits set below the truncation width
+  unsigned narrow[CONFIGCOUNT];     // no bits set between widths 16 and nfb
+} results;
+
+static void
+record(latency* l, int64_t us){
+  ++l->count;
+  l->total += us;
+  if(us > l->max){
+    l->max = us;
+  }
+}
+
+static void
+check_sample(results* r, unsigned idx, int32_t v){
+  const unsigned nfb = configs[idx].nfb;
+  ++r->checked[idx];
+  if(v & ((1l << (24 - nfb)) - 1)){
+    ++r->violations[idx];
+  }else if(!(v & ((1l << (24 - configs[0].nfb)) - 1))){
+    // consistent with the narrowest truncation. this happens by chance with
+    // probability 2^-(nfb - 16); much more often means a narrow truncation
+    // was applied to a wider configuration.
+    ++r->narrow[idx];
+  }
+}
+
+static void
+report(const char* phase, const results* r){
+  const latency* ls[] = { &r->ok, &r->notready, };
+  const char* names[] = { "ok", "not ready", };
+  for(unsigned i = 0 ; i < 2 ; ++i){
+    printf("%s: %u %s reads, mean %lldus, max %lldus\n", phase, ls[i]->count,
+           names[i], ls[i]->count ? ls[i]->total / ls[i]->count : 0, ls[i]->max);
+  }
+  printf("%s: %u errors, %u samples discarded\n", phase, r->errors, r->discarded);
+  for(unsigned i = 0 ; i < CONFIGCOUNT ; ++i){
+    if(!r->checked[i]){
+      continue;
+    }
+    printf("%s: %u SPS gain %u nfb %u: %u checked, %u violations, "
+           "%u narrow (expect ~%u)\n", phase, configs[i].rate, configs[i].gain,
+           configs[i].nfb, r->checked[i], r->violations[i], r->narrow[i],
+           r->checked[i] >> (configs[i].nfb - configs[0].nfb));
+  }
+}
+
+// read as fast as possible until the time is end (microseconds)
+static void
+reader(results* r, int64_t end){
+  do{
+    const unsigned s1 = atomic_load(&seq);
+    const unsigned idx = atomic_load(&cfgidx);
+    int32_t v;
+    const int64_t t0 = esp_timer_get_time();
+    const int e = nau7802_read(nau, &v);
+    const int64_t lat = esp_timer_get_time() - t0;
+    if(e == ESP_OK){
+      record(&r->ok, lat);
+      if(!(s1 & 1u) && atomic_load(&seq) == s1){
+        check_sample(r, idx, v);
+      }else{
+        ++r->discarded;
+      }
+    }else{
+      if(e == ESP_ERR_NOT_FINISHED){
+        record(&r->notready, lat);
+      }else{
+        ++r->errors;
+      }
+      // let the churn task run even if we share a core and priority
+      vTaskDelay(1);
+    }
+  }while(esp_timer_get_time() < end);
+}
+
+static void
+churn_task(void* arg){
+  unsigned i = 0;
+  while(!atomic_load(&done)){
+    i = (i + 1) % CONFIGCOUNT;
+    atomic_fetch_add(&seq, 1);
+    if(nau7802_set_sample_rate(nau, configs[i].rate) ||
+       nau7802_set_gain(nau, configs[i].gain)){
+      ESP_LOGE(TAG, "error changing configuration");
+    }
+    atomic_store(&cfgidx, i);
+    atomic_fetch_add(&seq, 1);
+    // let some samples through in each configuration
+    vTaskDelay(pdMS_TO_TICKS(50));
+  }
+  atomic_store(&exited, true);
+  vTaskDelete(NULL);
+}
+
+// returns non-zero if the phase couldn't be run
+static int
+run_phase(const char* phase, bool churn, unsigned seconds, results* r){
+  if(churn){
+    atomic_store(&done, false);
+    atomic_store(&exited, false);
+    if(xTaskCreate(churn_task, "churn", 4096, NULL, uxTaskPriorityGet(NULL),
+                   NULL) != pdPASS){
+      ESP_LOGE(TAG, "couldn't create churn task");
+      return -1;
+    }
+  }
+  reader(r, esp_timer_get_time() + seconds * 1000000ll);
+  if(churn){
+    atomic_store(&done, true);
+    while(!atomic_load(&exited)){
+      vTaskDelay(1);
+    }
+  }
+  report(phase, r);
+  return 0;
+}
+
+void app_main(void){
+  i2c_master_bus_config_t buscfg = {
+    .i2c_port = -1,
+    .sda_io_num = SDA_PIN,
+    .scl_io_num = SCL_PIN,
+    .clk_source = I2C_CLK_SRC_DEFAULT,
+    .glitch_ignore_cnt = 7,
+    .flags.enable_internal_pullup = true,
+  };
+  i2c_master_bus_handle_t bus;
+  esp_err_t e = i2c_new_master_bus(&buscfg, &bus);
+  if(e != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) creating I2C bus", esp_err_to_name(e));
+    return;
+  }
+  if(nau7802_detect(bus, &nau) || nau7802_reset(nau) || nau7802_poweron(nau)){
+    return;
+  }
+  for(unsigned i = 0 ; i < CONFIGCOUNT ; ++i){
+    if(nau7802_set_noise_free_bits(nau, configs[i].rate, configs[i].gain,
+                                   configs[i].nfb)){
+      return;
+    }
+  }
+  if(nau7802_set_sample_rate(nau, configs[0].rate) ||
+     nau7802_set_gain(nau, configs[0].gain)){
+    return;
+  }
+  // nau7802_read() logs every not-ready poll
+  esp_log_level_set("nau", ESP_LOG_NONE);
+  static results quiet, churned;
+  int ret = run_phase("quiet", false, QUIET_SECONDS, &quiet);
+  if(ret == 0){
+    ret = run_phase("churn", true, CHURN_SECONDS, &churned);
+  }
+  esp_log_level_set("nau", ESP_LOG_INFO);
+  if(ret){
+    return;
+  }
+  unsigned violations = 0;
+  for(unsigned i = 0 ; i < CONFIGCOUNT ; ++i){
+    violations += quiet.violations[i] + churned.violations[i];
+  }
+  if(violations){
+    ESP_LOGE(TAG, "%u samples had the wrong truncation width", violations);
+  }else{
+    ESP_LOGI(TAG, "no truncation violations");
+  }
+}
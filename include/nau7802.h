@@ -5,13 +5,31 @@
 
 // todo: add channel selection
 
+// all functions may be called from multiple tasks (save nau7802_release()).
+// functions which change the configuration (including those which run an
+// internal calibration) are serialized per device. before such a change
+// completes, any conversion already finished, and the one in progress, are
+// read and discarded (this costs up to two conversion periods). nau7802_read()
+// and nau7802_read_scaled() never wait on configuration changes; if one is
+// underway or completes during the read, they fail with ESP_ERR_NOT_FINISHED
+// as if data was not yet ready. a successful read thus returns a conversion
+// taken entirely under the current configuration, truncated accordingly.
+
 #include <esp_err.h>
 #include <driver/i2c_master.h>
 
 // probe the I2C bus for an NAU7802. if it is found, configure i2cnau
-// as a device handle for it, and return 0. return non-zero on error.
+// as a device handle for it, and return 0. return non-zero on error. the
+// driver tracks state for up to 4 devices; release them with
+// nau7802_release() when done (e.g. before re-detecting after a bus
+// recovery).
 int nau7802_detect(i2c_master_bus_handle_t i2c, i2c_master_dev_handle_t* i2cnau);
 
+// forget the state kept for this device, and remove it from its I2C bus.
+// no other call may be in progress or made for this handle afterwards.
+// returns non-zero on error.
+int nau7802_release(i2c_master_dev_handle_t i2c);
+
 // send the reset command w/ timeout. returns non-zero on error.
 int nau7802_reset(i2c_master_dev_handle_t i2c);
 
@@ -92,9 +110,43 @@ int nau7802_set_pga_cap(i2c_master_dev_handle_t i2c, bool enabled);
 
 // read the 24-bit ADC into val. this is a nonblocking function; if data is
 // not yet ready, it returns immediately with error. returns non-zero on error,
-// in which case *val is undefined. this is the raw ADC value.
+// in which case *val is undefined. this is the raw ADC value, with the bits
+// below the noise-free bits of the current gain and rate zeroed out (see
+// nau7802_set_noise_free_bits()).
 int nau7802_read(i2c_master_dev_handle_t i2c, int32_t* val);
 
+// noise characteristics of the current configuration, as measured by
+// nau7802_characterize(). all values are in raw ADC codes unless noted.
+typedef struct nau7802_noise_stats {
+  unsigned samples;       // number of samples collected
+  double mean;            // mean ADC value
+  double rms_noise;       // standard deviation of the samples
+  int32_t peak_to_peak;   // largest sample minus smallest sample
+  double enob;            // effective bits, log2(2^24 / rms_noise)
+  double noise_free_bits; // log2(2^24 / peak_to_peak)
+  double sample_rate;     // samples per second actually achieved
+  double bus_xfers;       // I2C transactions per sample, including polls
+  double conversion_rate; // expected samples per second, using the clock
+                          // from nau7802_measure_clock()
+} nau7802_noise_stats;
+
+// collect n (at least 2) untruncated samples in the current configuration,
+// and fill in stats. this blocks until all n samples have been read,
+// sleeping for most of each conversion period and polling the device for the
+// rest. the input ought be held constant (e.g. an unloaded load cell, or
+// shorted inputs) throughout. returns non-zero on error.
+int nau7802_characterize(i2c_master_dev_handle_t i2c, unsigned n,
+                         nau7802_noise_stats* stats);
+
+// set the number of noise-free bits (1 through 24) kept by nau7802_read()
+// at the given sample rate and gain (validated as by nau7802_set_sample_rate()
+// and nau7802_set_gain()). each rate/gain pair has its own value, 20 by
+// default. the device needn't be in that configuration, so a table measured
+// with nau7802_characterize() (take the floor of noise_free_bits) can be
+// loaded without reconfiguring. returns non-zero on error.
+int nau7802_set_noise_free_bits(i2c_master_dev_handle_t i2c, unsigned rate,
+                                unsigned gain, unsigned bits);
+
 // read the 24-bit ADC, interpreting it using some maximum value scale. i.e. if
 // scale is 5000000 (representing e.g. a small bar load cell capable of 5kg, in
 // mg increments), the raw ADC value will be divided by 1677.7216 (1 << 23 /
@@ -122,4 +174,25 @@ int nau7802_set_deepsleep(i2c_master_dev_handle_t i2c, bool powerdown);
 // behavior of indicating data readiness.
 int nau7802_export_clock(i2c_master_dev_handle_t i2c, bool clock);
 
+// the sample rates are derived from a nominally 4.9152MHz oscillator, which
+// drifts (with temperature, AVDD, and part-to-part). measure the actual
+// clock by exporting it on DRDY (which must be wired to drdy_gpio) and
+// counting its rising edges with a PCNT unit for ms milliseconds (at least
+// one tick, at most 10000; longer windows are more precise). DRDY is
+// returned to indicating data readiness afterwards, even on failure. a
+// result more than 10% from nominal is rejected as a wiring problem. the
+// result is kept for this device until measured again, and is used for
+// nau7802_conversion_period(). it is not affected by nau7802_reset(). call
+// this periodically (and with the sensor idle) to track drift. returns
+// non-zero on error. on targets without PCNT (e.g. ESP32-C2 and ESP32-C3),
+// this always fails.
+int nau7802_measure_clock(i2c_master_dev_handle_t i2c, int drdy_gpio, unsigned ms);
+
+// get the conversion period in nanoseconds at the current sample rate,
+// according to the most recently measured clock (or the nominal clock, if
+// it has never been measured). use this rather than the nominal sample rate
+// when timestamping samples or computing filter coefficients. returns
+// non-zero on error.
+int nau7802_conversion_period(i2c_master_dev_handle_t i2c, uint32_t* period);
+
 #endif
@@ -1,6 +1,16 @@
 #include "nau7802.h"
+#include <math.h>
+#include <limits.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <soc/soc_caps.h>
+#if SOC_PCNT_SUPPORTED
+#include <driver/pulse_cnt.h>
+#endif
 
 #define TIMEOUT_MS 1000 // FIXME why 1s?
 
@@ -62,6 +72,224 @@ typedef enum {
 
 #define NAU7802_ADDRESS 0x2A
 
+// DRDY_SEL bit within CTRL1: export the clock on DRDY rather than readiness
+#define NAU7802_CTRL1_DRDY_SEL 0x40
+
+// nominal frequency of the internal RC oscillator. the sample rates are
+// derived from this clock, and drift with it.
+#define NOMINAL_CLOCK_HZ 4915200ul
+
+// a measured clock further than this from nominal is assumed to be a wiring
+// problem (e.g. a floating pin, or DRDY still indicating data readiness).
+#define CLOCK_TOLERANCE_PCT 10
+
+// sample rates supported by CRS in CTRL2, in increasing order
+static const unsigned rates[] = { 10, 20, 40, 80, 320 };
+#define RATECOUNT (sizeof(rates) / sizeof(*rates))
+
+// gain index 0 is PGA bypass; gain index n > 0 is gain 1 << (n - 1)
+#define GAINCOUNT 9
+
+// noise-free bits kept for each configuration until told otherwise. this
+// matches what we've always done (dropping the low nibble). measure your
+// board with nau7802_characterize() and install the results with
+// nau7802_set_noise_free_bits().
+#define DEFAULT_NFB 20
+
+// get the index into rates[] for a sample rate, or RATECOUNT if invalid
+static unsigned
+nau7802_rate_index(unsigned rate){
+  unsigned rateidx;
+  for(rateidx = 0 ; rateidx < RATECOUNT ; ++rateidx){
+    if(rates[rateidx] == rate){
+      break;
+    }
+  }
+  return rateidx;
+}
+
+// get the gain index for a gain (0 for PGA bypass, otherwise a power of 2
+// no greater than 128), or GAINCOUNT if invalid
+static unsigned
+nau7802_gain_index(unsigned gain){
+  if(gain > 128 || (gain != 0 && (gain & (gain - 1)))){
+    return GAINCOUNT;
+  }
+  return gain ? __builtin_ctz(gain) + 1 : 0;
+}
+
+// the NAU7802 has a fixed address, so there can be at most one per I2C bus.
+#define NAU7802_MAX_DEVICES 4
+
+// per-device state, keyed by the I2C device handle. we track the
+// configuration so that reads needn't go back to the device for it.
+//
+// configuration changes (including calibration) hold lock for their
+// duration, and bump gen to an odd value on entry and back to an even value
+// on exit. the sample read path never takes lock; it reads gen before and
+// after, discarding the sample if gen was odd or changed. everything it
+// needs from the configuration is published in the atomic fields.
+typedef struct nau7802_state {
+  i2c_master_dev_handle_t i2c; // NULL if this slot is unused
+  atomic_bool ready;           // set once the slot is initialized
+  StaticSemaphore_t lockbuf;
+  SemaphoreHandle_t lock;      // exclusive configuration lock
+  atomic_uint gen;             // configuration generation, odd while changing
+  // the remainder are only written while holding lock
+  unsigned rateidx;            // index into rates[]
+  unsigned gainidx;            // 0 for PGA bypass, otherwise log2(gain) + 1
+  uint8_t nfb[RATECOUNT][GAINCOUNT]; // noise-free bits per configuration
+  uint32_t clock_hz;           // measured conversion clock (not reset)
+  // published from the above by nau7802_publish() for lockless readers
+  atomic_uint curnfb;          // noise-free bits of current configuration
+  atomic_uint period;          // conversion period in nanoseconds
+} nau7802_state;
+
+static nau7802_state devices[NAU7802_MAX_DEVICES];
+static portMUX_TYPE devlock = portMUX_INITIALIZER_UNLOCKED;
+
+// the configuration following reset
+static void
+nau7802_state_defaults(nau7802_state* ns){
+  ns->rateidx = 0; // 10 SPS
+  ns->gainidx = 1; // gain of 1
+}
+
+// the conversion period of the current sample rate in nanoseconds, scaled
+// by the measured clock.
+static uint64_t
+nau7802_period_ns(const nau7802_state* ns){
+  return (uint64_t)NOMINAL_CLOCK_HZ * 1000000000ull /
+          ((uint64_t)rates[ns->rateidx] * ns->clock_hz);
+}
+
+// make the configuration visible to lockless readers. lock must be held.
+static void
+nau7802_publish(nau7802_state* ns){
+  atomic_store_explicit(&ns->curnfb, ns->nfb[ns->rateidx][ns->gainidx],
+                        memory_order_relaxed);
+  atomic_store_explicit(&ns->period, nau7802_period_ns(ns), memory_order_relaxed);
+}
+
+// sleep until shortly before the next conversion is expected, given that
+// the previous one was read at last (microseconds). we sleep only in whole
+// ticks, always waking early, and poll from there.
+static void
+nau7802_await_conversion(const nau7802_state* ns, int64_t last){
+  const unsigned period = atomic_load_explicit(&ns->period, memory_order_relaxed);
+  const int64_t due = last + period / 1000;
+  const int64_t remaining = due - esp_timer_get_time();
+  const TickType_t ticks = remaining > 0 ? remaining / 1000 / portTICK_PERIOD_MS : 0;
+  if(ticks){
+    vTaskDelay(ticks);
+  }
+}
+
+// look up the state for a registered handle, taking no locks. returns NULL
+// if the handle is not registered.
+static nau7802_state*
+nau7802_state_find(i2c_master_dev_handle_t i2c){
+  for(unsigned i = 0 ; i < NAU7802_MAX_DEVICES ; ++i){
+    // i2c is written before ready is set, and doesn't change until the
+    // slot is released (see nau7802_release())
+    if(atomic_load_explicit(&devices[i].ready, memory_order_acquire) &&
+        devices[i].i2c == i2c){
+      return &devices[i];
+    }
+  }
+  return NULL;
+}
+
+// look up the state for this handle, registering it if it's new (handles
+// from nau7802_detect() are registered there; others are registered on
+// first use). returns NULL if we're already tracking NAU7802_MAX_DEVICES
+// other devices.
+static nau7802_state*
+nau7802_state_get(i2c_master_dev_handle_t i2c){
+  nau7802_state* ns = nau7802_state_find(i2c);
+  if(ns){
+    return ns;
+  }
+  nau7802_state* freeslot = NULL;
+  taskENTER_CRITICAL(&devlock);
+  for(unsigned i = 0 ; i < NAU7802_MAX_DEVICES ; ++i){
+    if(devices[i].i2c == i2c){
+      ns = &devices[i];
+      break;
+    }
+    if(!devices[i].i2c && !freeslot){
+      freeslot = &devices[i];
+    }
+  }
+  bool claimed = false;
+  if(!ns && freeslot){
+    ns = freeslot;
+    ns->i2c = i2c;
+    claimed = true;
+  }
+  taskEXIT_CRITICAL(&devlock);
+  if(!ns){
+    ESP_LOGE(TAG, "can't track more than %d devices (use nau7802_release())",
+             NAU7802_MAX_DEVICES);
+    return NULL;
+  }
+  if(claimed){
+    ns->lock = xSemaphoreCreateMutexStatic(&ns->lockbuf);
+    atomic_init(&ns->gen, 0);
+    memset(ns->nfb, DEFAULT_NFB, sizeof(ns->nfb));
+    ns->clock_hz = NOMINAL_CLOCK_HZ;
+    nau7802_state_defaults(ns);
+    nau7802_publish(ns);
+    atomic_store_explicit(&ns->ready, true, memory_order_release);
+  }else{
+    // another task is registering this same handle
+    while(!atomic_load_explicit(&ns->ready, memory_order_acquire)){
+      vTaskDelay(1);
+    }
+  }
+  return ns;
+}
+
+// take the configuration lock, and mark the configuration as changing.
+// returns NULL on error.
+static nau7802_state*
+nau7802_config_lock(i2c_master_dev_handle_t i2c){
+  nau7802_state* ns = nau7802_state_get(i2c);
+  if(ns){
+    xSemaphoreTake(ns->lock, portMAX_DELAY);
+    atomic_fetch_add_explicit(&ns->gen, 1, memory_order_relaxed);
+    // order the odd generation before any device or state modification
+    atomic_thread_fence(memory_order_release);
+  }
+  return ns;
+}
+
+// if a configuration change is underway, block until it completes. blocking
+// readers must use this rather than retrying, lest they starve the task
+// making the change (which waiting on the lock gives priority inheritance).
+static void
+nau7802_await_config(const nau7802_state* ns){
+  if(atomic_load_explicit(&ns->gen, memory_order_acquire) & 1u){
+    xSemaphoreTake(ns->lock, portMAX_DELAY);
+    xSemaphoreGive(ns->lock);
+  }
+}
+
+static void nau7802_drain(const nau7802_state* ns);
+
+// publish the new configuration, mark it stable, and drop the lock. if the
+// change can affect samples, first set drain, so that any conversion which
+// predates or straddles the change is discarded.
+static void
+nau7802_config_unlock(nau7802_state* ns, bool drain){
+  if(drain){
+    nau7802_drain(ns);
+  }
+  nau7802_publish(ns);
+  atomic_fetch_add_explicit(&ns->gen, 1, memory_order_release);
+  xSemaphoreGive(ns->lock);
+}
+
 int nau7802_detect(i2c_master_bus_handle_t i2c, i2c_master_dev_handle_t* i2cnau){
   const unsigned addr = NAU7802_ADDRESS;
   esp_err_t e = i2c_master_probe(i2c, addr, TIMEOUT_MS);
@@ -79,6 +307,30 @@ int nau7802_detect(i2c_master_bus_handle_t i2c, i2c_master_dev_handle_t* i2cnau)
     ESP_LOGE(TAG, "error (%s) adding nau7802 i2c device", esp_err_to_name(e));
     return -1;
   }
+  if(!nau7802_state_get(*i2cnau)){
+    i2c_master_bus_rm_device(*i2cnau);
+    return -1;
+  }
+  return 0;
+}
+
+int nau7802_release(i2c_master_dev_handle_t i2c){
+  nau7802_state* ns = nau7802_state_find(i2c);
+  if(ns){
+    // wait out any configuration change
+    xSemaphoreTake(ns->lock, portMAX_DELAY);
+    taskENTER_CRITICAL(&devlock);
+    atomic_store_explicit(&ns->ready, false, memory_order_relaxed);
+    ns->i2c = NULL;
+    taskEXIT_CRITICAL(&devlock);
+    xSemaphoreGive(ns->lock);
+    vSemaphoreDelete(ns->lock);
+  }
+  esp_err_t e = i2c_master_bus_rm_device(i2c);
+  if(e != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) removing nau7802 i2c device", esp_err_to_name(e));
+    return -1;
+  }
   return 0;
 }
 
@@ -94,15 +346,21 @@ nau7802_xmit(i2c_master_dev_handle_t i2c, const void* buf, size_t blen){
 }
 
 int nau7802_reset(i2c_master_dev_handle_t i2c){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
   uint8_t buf[] = {
     NAU7802_PU_CTRL,
     NAU7802_PU_CTRL_RR
   };
-  if(nau7802_xmit(i2c, buf, sizeof(buf))){
-    return -1;
+  int ret = nau7802_xmit(i2c, buf, sizeof(buf));
+  if(ret == 0){
+    nau7802_state_defaults(ns);
+    ESP_LOGI(TAG, "reset NAU7802");
   }
-  ESP_LOGI(TAG, "reset NAU7802");
-  return 0;
+  nau7802_config_unlock(ns, true);
+  return ret;
 }
 
 // get the single byte of some register
@@ -139,6 +397,53 @@ nau7802_pga(i2c_master_dev_handle_t i2c, uint8_t* val){
   return nau7802_readreg(i2c, NAU7802_PGA, "PGA", val);
 }
 
+// read and throw away the ADC output, clearing CR
+static esp_err_t
+nau7802_discard_sample(i2c_master_dev_handle_t i2c){
+  uint8_t r;
+  esp_err_t e;
+  if((e = nau7802_readreg(i2c, NAU7802_ADCO_B2, "ADCO_B2", &r)) != ESP_OK){
+    return e;
+  }
+  if((e = nau7802_readreg(i2c, NAU7802_ADCO_B1, "ADCO_B1", &r)) != ESP_OK){
+    return e;
+  }
+  return nau7802_readreg(i2c, NAU7802_ADCO_B0, "ADCO_B0", &r);
+}
+
+// discard a completed conversion (if CR is set), then wait for and discard
+// the conversion in progress. either might have been taken (wholly or in
+// part) under the old configuration. if the device isn't converting (it's
+// powered down or reset), there's nothing to do. lock must be held, and gen
+// must be odd, so that readers don't take these samples themselves.
+static void
+nau7802_drain(const nau7802_state* ns){
+  const uint8_t converting = NAU7802_PU_CTRL_PUD | NAU7802_PU_CTRL_PUA |
+                             NAU7802_PU_CTRL_CS;
+  uint8_t r;
+  if(nau7802_pu_ctrl(ns->i2c, &r) || (r & converting) != converting){
+    return;
+  }
+  if((r & NAU7802_PU_CTRL_CR) && nau7802_discard_sample(ns->i2c)){
+    return;
+  }
+  // the conversion in progress ends within a period; allow another, plus a
+  // tick for our own sleep granularity.
+  const int64_t deadline = esp_timer_get_time() +
+    2 * (nau7802_period_ns(ns) / 1000) + portTICK_PERIOD_MS * 1000;
+  do{
+    vTaskDelay(1);
+    if(nau7802_pu_ctrl(ns->i2c, &r)){
+      return;
+    }
+    if(r & NAU7802_PU_CTRL_CR){
+      nau7802_discard_sample(ns->i2c);
+      return;
+    }
+  }while(esp_timer_get_time() < deadline);
+  ESP_LOGW(TAG, "no conversion completed while draining");
+}
+
 static int
 nau7802_internal_calibrate(i2c_master_dev_handle_t i2c){
   uint8_t r;
@@ -174,7 +479,8 @@ nau7802_internal_calibrate(i2c_master_dev_handle_t i2c){
 //
 // we ought also "wait through six cycles of data conversion" (1.14),
 // but are not yet doing so.
-int nau7802_poweron(i2c_master_dev_handle_t i2c){
+static int
+nau7802_poweron_locked(i2c_master_dev_handle_t i2c){
   uint8_t buf[] = {
     NAU7802_PU_CTRL,
     NAU7802_PU_CTRL_PUD | NAU7802_PU_CTRL_PUA
@@ -223,8 +529,19 @@ int nau7802_poweron(i2c_master_dev_handle_t i2c){
   return 0;
 }
 
+int nau7802_poweron(i2c_master_dev_handle_t i2c){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_poweron_locked(i2c);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
 // FIXME also have to cut PGA <= 2
-int nau7802_set_therm(i2c_master_dev_handle_t i2c, bool enabled){
+static int
+nau7802_set_therm_locked(i2c_master_dev_handle_t i2c, bool enabled){
   uint8_t buf[] = {
     NAU7802_I2C_CONTROL,
     0x0
@@ -245,7 +562,18 @@ int nau7802_set_therm(i2c_master_dev_handle_t i2c, bool enabled){
   return 0;
 }
 
-int nau7802_set_bandgap_chop(i2c_master_dev_handle_t i2c, bool enabled){
+int nau7802_set_therm(i2c_master_dev_handle_t i2c, bool enabled){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_set_therm_locked(i2c, enabled);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
+static int
+nau7802_set_bandgap_chop_locked(i2c_master_dev_handle_t i2c, bool enabled){
   uint8_t buf[] = {
     NAU7802_I2C_CONTROL,
     0x0
@@ -254,7 +582,7 @@ int nau7802_set_bandgap_chop(i2c_master_dev_handle_t i2c, bool enabled){
     return -1;
   }
   if(enabled){ // disabled is 1
-    buf[1] &= NAU7802_PGA_CHPDIS; // clear 0x01 BGPCP
+    buf[1] &= ~NAU7802_PGA_CHPDIS; // clear 0x01 BGPCP
   }else{
     buf[1] |= NAU7802_PGA_CHPDIS; // set 0x01 BGPCP
   }
@@ -266,7 +594,18 @@ int nau7802_set_bandgap_chop(i2c_master_dev_handle_t i2c, bool enabled){
   return 0;
 }
 
-int nau7802_set_pga_cap(i2c_master_dev_handle_t i2c, bool enabled){
+int nau7802_set_bandgap_chop(i2c_master_dev_handle_t i2c, bool enabled){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_set_bandgap_chop_locked(i2c, enabled);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
+static int
+nau7802_set_pga_cap_locked(i2c_master_dev_handle_t i2c, bool enabled){
   uint8_t buf[] = {
     NAU7802_PGA_PWR,
     0x0
@@ -289,6 +628,16 @@ int nau7802_set_pga_cap(i2c_master_dev_handle_t i2c, bool enabled){
   return 0;
 }
 
+int nau7802_set_pga_cap(i2c_master_dev_handle_t i2c, bool enabled){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_set_pga_cap_locked(i2c, enabled);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
 static int
 nau7802_set_pgabypass(i2c_master_dev_handle_t i2c, bool bypass){
   uint8_t buf[] = {
@@ -309,14 +658,16 @@ nau7802_set_pgabypass(i2c_master_dev_handle_t i2c, bool bypass){
   return 0;
 }
 
-int nau7802_set_gain(i2c_master_dev_handle_t i2c, unsigned gain){
+static int
+nau7802_set_gain_locked(nau7802_state* ns, i2c_master_dev_handle_t i2c,
+                        unsigned gain, unsigned gainidx){
   uint8_t rbuf;
-  if(gain > 128 || (gain != 0 && (gain & (gain - 1)))){
-    ESP_LOGE(TAG, "illegal gain value %u", gain);
-    return -1;
-  }
   if(gain == 0){
-    return nau7802_set_pgabypass(i2c, true);
+    if(nau7802_set_pgabypass(i2c, true)){
+      return -1;
+    }
+    ns->gainidx = 0;
+    return 0;
   }
   // pga bypass is disabled by default, so maybe just track this rather than
   // writing it every time? eh, setting gain is an infrequent operation.
@@ -351,6 +702,7 @@ int nau7802_set_gain(i2c_master_dev_handle_t i2c, unsigned gain){
     ESP_LOGE(TAG, "CTRL1 reply 0x%02x didn't match 0x%02x", rbuf, buf[1]);
     return -1;
   }
+  ns->gainidx = gainidx;
   ESP_LOGI(TAG, "set gain");
   if(nau7802_internal_calibrate(i2c)){
     return -1;
@@ -358,12 +710,27 @@ int nau7802_set_gain(i2c_master_dev_handle_t i2c, unsigned gain){
   return 0;
 }
 
-int nau7802_set_sample_rate(i2c_master_dev_handle_t i2c, unsigned rate){
-  uint8_t rbuf;
-  if(rate != 10 && rate != 20 && rate != 40 && rate != 80 && rate != 320){
-    ESP_LOGE(TAG, "illegal rate value %u", rate);
+int nau7802_set_gain(i2c_master_dev_handle_t i2c, unsigned gain){
+  // validate before taking the lock, so that bad arguments don't disturb
+  // concurrent readers
+  const unsigned gainidx = nau7802_gain_index(gain);
+  if(gainidx == GAINCOUNT){
+    ESP_LOGE(TAG, "illegal gain value %u", gain);
+    return -1;
+  }
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
     return -1;
   }
+  int ret = nau7802_set_gain_locked(ns, i2c, gain, gainidx);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
+static int
+nau7802_set_sample_rate_locked(nau7802_state* ns, i2c_master_dev_handle_t i2c,
+                               unsigned rate, unsigned rateidx){
+  uint8_t rbuf;
   uint8_t buf[] = {
     NAU7802_CTRL2,
     0xff
@@ -372,7 +739,7 @@ int nau7802_set_sample_rate(i2c_master_dev_handle_t i2c, unsigned rate){
   if(nau7802_ctrl2(i2c, &buf[1])){
     return -1;
   }
-  buf[1] &= 0x10001111;
+  buf[1] &= 0b10001111;
   if(rate == 10){
     buf[1] |= 0b000 << 4;
   }else if(rate == 20){
@@ -394,6 +761,7 @@ int nau7802_set_sample_rate(i2c_master_dev_handle_t i2c, unsigned rate){
     ESP_LOGE(TAG, "CTRL2 reply 0x%02x didn't match 0x%02x", rbuf, buf[1]);
     return -1;
   }
+  ns->rateidx = rateidx;
   ESP_LOGI(TAG, "set rate");
   if(nau7802_internal_calibrate(i2c)){
     return -1;
@@ -401,6 +769,21 @@ int nau7802_set_sample_rate(i2c_master_dev_handle_t i2c, unsigned rate){
   return 0;
 }
 
+int nau7802_set_sample_rate(i2c_master_dev_handle_t i2c, unsigned rate){
+  const unsigned rateidx = nau7802_rate_index(rate);
+  if(rateidx == RATECOUNT){
+    ESP_LOGE(TAG, "illegal rate value %u", rate);
+    return -1;
+  }
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_set_sample_rate_locked(ns, i2c, rate, rateidx);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
 // set the PGA LDOMODE (*not* the master AVDDS/LDO switch)
 static int
 nau7802_set_pgaldomode(i2c_master_dev_handle_t i2c, bool ldomode){
@@ -444,7 +827,8 @@ nau7802_set_ldo(i2c_master_dev_handle_t i2c, bool ldomode){
   return 0;
 }
 
-int nau7802_disable_ldo(i2c_master_dev_handle_t i2c){
+static int
+nau7802_disable_ldo_locked(i2c_master_dev_handle_t i2c){
   if(nau7802_set_ldo(i2c, false)){
     return -1;
   }
@@ -455,12 +839,19 @@ int nau7802_disable_ldo(i2c_master_dev_handle_t i2c){
   return 0;
 }
 
-int nau7802_enable_ldo(i2c_master_dev_handle_t i2c, nau7802_ldo_level mode,
-                       bool pga_ldomode){
-  if(mode > NAU7802_LDO_24V || mode < NAU7802_LDO_45V){
-    ESP_LOGW(TAG, "illegal LDO mode %d", mode);
+int nau7802_disable_ldo(i2c_master_dev_handle_t i2c){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
     return -1;
   }
+  int ret = nau7802_disable_ldo_locked(i2c);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
+static int
+nau7802_enable_ldo_locked(i2c_master_dev_handle_t i2c, nau7802_ldo_level mode,
+                          bool pga_ldomode){
   uint8_t buf[] = {
     NAU7802_CTRL1, // we need first set the LDO voltage in CTRL1 (VLDO)
     0xff
@@ -494,6 +885,21 @@ int nau7802_enable_ldo(i2c_master_dev_handle_t i2c, nau7802_ldo_level mode,
   return 0;
 }
 
+int nau7802_enable_ldo(i2c_master_dev_handle_t i2c, nau7802_ldo_level mode,
+                       bool pga_ldomode){
+  if(mode > NAU7802_LDO_24V || mode < NAU7802_LDO_45V){
+    ESP_LOGW(TAG, "illegal LDO mode %d", mode);
+    return -1;
+  }
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_enable_ldo_locked(i2c, mode, pga_ldomode);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
 int nau7802_read_scaled(i2c_master_dev_handle_t i2c, float* val, uint32_t scale){
   int32_t v;
   if(nau7802_read(i2c, &v)){
@@ -506,11 +912,39 @@ int nau7802_read_scaled(i2c_master_dev_handle_t i2c, float* val, uint32_t scale)
   return 0;
 }
 
+// if xfers is not NULL, it is incremented for each I2C transaction. if
+// truncate is set, the result is chopped to the noise-free bits of the
+// current configuration.
 static esp_err_t
-nau7802_read_internal(i2c_master_dev_handle_t i2c, int32_t* val, bool lognodata){
+nau7802_read_internal(i2c_master_dev_handle_t i2c, int32_t* val, bool lognodata,
+                      bool truncate, unsigned* xfers){
   uint8_t r0, r1, r2;
   esp_err_t e;
-  if((e = nau7802_pu_ctrl(i2c, &r0)) != ESP_OK){
+  // an unregistered handle has never been configured through us, and thus
+  // has the default configuration.
+  const nau7802_state* ns = nau7802_state_find(i2c);
+  unsigned gen = 0;
+  unsigned nfb = DEFAULT_NFB;
+  if(ns){
+    // never wait on the configuration lock; if the configuration is
+    // changing, there's no data ready in it.
+    gen = atomic_load_explicit(&ns->gen, memory_order_acquire);
+    if(gen & 1u){
+      if(lognodata){
+        ESP_LOGE(TAG, "configuration is changing");
+      }
+      return ESP_ERR_NOT_FINISHED;
+    }
+    nfb = atomic_load_explicit(&ns->curnfb, memory_order_relaxed);
+  }
+  if(!truncate){
+    nfb = 24;
+  }
+  e = nau7802_pu_ctrl(i2c, &r0);
+  if(xfers){
+    ++*xfers;
+  }
+  if(e != ESP_OK){
     return e;
   }
   if(!(r0 & NAU7802_PU_CTRL_CR)){
@@ -519,6 +953,9 @@ nau7802_read_internal(i2c_master_dev_handle_t i2c, int32_t* val, bool lognodata)
     }
     return ESP_ERR_NOT_FINISHED;
   }
+  if(xfers){
+    *xfers += 3;
+  }
   if((e = nau7802_readreg(i2c, NAU7802_ADCO_B2, "ADCO_B2", &r2)) != ESP_OK){
     return e;
   }
@@ -528,11 +965,18 @@ nau7802_read_internal(i2c_master_dev_handle_t i2c, int32_t* val, bool lognodata)
   if((e = nau7802_readreg(i2c, NAU7802_ADCO_B0, "ADCO_B0", &r0)) != ESP_OK){
     return e;
   }
-  // FIXME chop to noise_free_bits according to AVDD and PGA. we never have
-  // more than 20 noise free bits nor less than 16, so modifications are
-  // restricted to r0.
-  const int32_t mask = 0xf0;
-  *val = (r2 << 16u) + (r1 << 8u) + (r0 & mask);
+  // if the configuration changed underneath us, the sample (and nfb) might
+  // belong to either configuration, or neither. throw it away.
+  atomic_thread_fence(memory_order_acquire);
+  if(ns && atomic_load_explicit(&ns->gen, memory_order_relaxed) != gen){
+    if(lognodata){
+      ESP_LOGE(TAG, "configuration changed during read");
+    }
+    return ESP_ERR_NOT_FINISHED;
+  }
+  // chop to the noise-free bits of this gain and rate
+  const int32_t mask = (0xffffffu << (24u - nfb)) & 0xffffffu;
+  *val = ((r2 << 16u) + (r1 << 8u) + r0) & mask;
   // if the most significant bit of the 24-bit output is set, then propagate
   // it to the 32-bit return value.
   if (*val & 0x800000) {
@@ -543,19 +987,23 @@ nau7802_read_internal(i2c_master_dev_handle_t i2c, int32_t* val, bool lognodata)
 }
 
 int nau7802_read(i2c_master_dev_handle_t i2c, int32_t* val){
-  return nau7802_read_internal(i2c, val, true);
+  return nau7802_read_internal(i2c, val, true, true, NULL);
 }
 
 esp_err_t nau7802_multisample(i2c_master_dev_handle_t i2c, float* val, unsigned n){
+  const nau7802_state* ns = nau7802_state_find(i2c);
   float sum = 0;
   for(unsigned z = 0 ; z < n ; ++z){
     int32_t v;
     esp_err_t e;
     do{
-      e = nau7802_read_internal(i2c, &v, false);
+      e = nau7802_read_internal(i2c, &v, false, true, NULL);
       if(e != ESP_OK && e != ESP_ERR_NOT_FINISHED){
         return e;
       }
+      if(e != ESP_OK && ns){
+        nau7802_await_config(ns);
+      }
     }while(e != ESP_OK);
     // accumulating into this 32-bit float can result in inaccurate maths if we
     // go beyond 1 << 24u
@@ -565,7 +1013,119 @@ esp_err_t nau7802_multisample(i2c_master_dev_handle_t i2c, float* val, unsigned
   return ESP_OK;
 }
 
-int nau7802_set_deepsleep(i2c_master_dev_handle_t i2c, bool powerdown){
+int nau7802_set_noise_free_bits(i2c_master_dev_handle_t i2c, unsigned rate,
+                                unsigned gain, unsigned bits){
+  const unsigned rateidx = nau7802_rate_index(rate);
+  if(rateidx == RATECOUNT){
+    ESP_LOGE(TAG, "illegal rate value %u", rate);
+    return -1;
+  }
+  const unsigned gainidx = nau7802_gain_index(gain);
+  if(gainidx == GAINCOUNT){
+    ESP_LOGE(TAG, "illegal gain value %u", gain);
+    return -1;
+  }
+  if(bits < 1 || bits > 24){
+    ESP_LOGE(TAG, "illegal noise-free bits %u", bits);
+    return -1;
+  }
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  ns->nfb[rateidx][gainidx] = bits;
+  ESP_LOGI(TAG, "set %u noise-free bits at %u SPS, gain %u", bits, rate, gain);
+  nau7802_config_unlock(ns, false);
+  return 0;
+}
+
+int nau7802_characterize(i2c_master_dev_handle_t i2c, unsigned n,
+                         nau7802_noise_stats* stats){
+  if(n < 2){
+    ESP_LOGE(TAG, "need at least 2 samples, got %u", n);
+    return -1;
+  }
+  const nau7802_state* ns = nau7802_state_get(i2c);
+  if(!ns){
+    return -1;
+  }
+  nau7802_await_config(ns);
+  const unsigned gen = atomic_load_explicit(&ns->gen, memory_order_acquire);
+  if(gen & 1u){
+    ESP_LOGE(TAG, "configuration is changing");
+    return -1;
+  }
+  // running mean and sum of squared deviations (Welford), so that we
+  // needn't buffer the samples.
+  double mean = 0;
+  double m2 = 0;
+  int32_t minv = INT32_MAX;
+  int32_t maxv = INT32_MIN;
+  unsigned xfers = 0;
+  int64_t t0 = 0;
+  int64_t last = 0;
+  for(unsigned z = 0 ; z < n ; ++z){
+    int32_t v;
+    esp_err_t e;
+    if(z){
+      nau7802_await_conversion(ns, last);
+    }
+    do{
+      e = nau7802_read_internal(i2c, &v, false, false, &xfers);
+      if(e != ESP_OK && e != ESP_ERR_NOT_FINISHED){
+        return -1;
+      }
+      // rather than spinning through a configuration change, give up; the
+      // samples would be from a mix of configurations anyway.
+      if(e != ESP_OK && atomic_load_explicit(&ns->gen, memory_order_acquire) != gen){
+        ESP_LOGE(TAG, "configuration changed during characterization");
+        return -1;
+      }
+    }while(e != ESP_OK);
+    last = esp_timer_get_time();
+    // time from the first conversion, so we don't count time spent waiting
+    // for it (which depends on when we were called).
+    if(z == 0){
+      t0 = last;
+    }
+    const double delta = v - mean;
+    mean += delta / (z + 1);
+    m2 += delta * (v - mean);
+    if(v < minv){
+      minv = v;
+    }
+    if(v > maxv){
+      maxv = v;
+    }
+  }
+  if(atomic_load_explicit(&ns->gen, memory_order_acquire) != gen){
+    ESP_LOGE(TAG, "configuration changed during characterization");
+    return -1;
+  }
+  const int64_t elapsed = last - t0;
+  const double fullscale = 1u << 24u;
+  stats->samples = n;
+  stats->mean = mean;
+  stats->rms_noise = sqrt(m2 / (n - 1));
+  stats->peak_to_peak = maxv - minv;
+  stats->enob = stats->rms_noise > 0 ? log2(fullscale / stats->rms_noise) : 24;
+  if(stats->enob > 24){
+    stats->enob = 24;
+  }
+  stats->noise_free_bits = stats->peak_to_peak ? log2(fullscale / stats->peak_to_peak) : 24;
+  stats->sample_rate = elapsed > 0 ? (n - 1) * 1000000.0 / elapsed : 0;
+  stats->bus_xfers = (double)xfers / n;
+  stats->conversion_rate = 1000000000.0 /
+    atomic_load_explicit(&ns->period, memory_order_relaxed);
+  ESP_LOGI(TAG, "%u samples: mean %f rms %f p-p %ld enob %.2f nfb %.2f %.2f/%.2f SPS %.2f xfers",
+           n, stats->mean, stats->rms_noise, stats->peak_to_peak, stats->enob,
+           stats->noise_free_bits, stats->sample_rate, stats->conversion_rate,
+           stats->bus_xfers);
+  return 0;
+}
+
+static int
+nau7802_set_deepsleep_locked(i2c_master_dev_handle_t i2c, bool powerdown){
   uint8_t buf[] = {
     NAU7802_PU_CTRL,
     0xff
@@ -597,3 +1157,174 @@ int nau7802_set_deepsleep(i2c_master_dev_handle_t i2c, bool powerdown){
   }
   return 0;
 }
+
+int nau7802_set_deepsleep(i2c_master_dev_handle_t i2c, bool powerdown){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_set_deepsleep_locked(i2c, powerdown);
+  nau7802_config_unlock(ns, true);
+  return ret;
+}
+
+static int
+nau7802_set_drdy_sel(i2c_master_dev_handle_t i2c, bool clock){
+  uint8_t buf[] = {
+    NAU7802_CTRL1,
+    0xff
+  };
+  if(nau7802_ctrl1(i2c, &buf[1])){
+    return -1;
+  }
+  if(clock){
+    buf[1] |= NAU7802_CTRL1_DRDY_SEL;
+  }else{
+    buf[1] &= ~NAU7802_CTRL1_DRDY_SEL;
+  }
+  if(nau7802_xmit(i2c, buf, sizeof(buf))){
+    return -1;
+  }
+  ESP_LOGI(TAG, "set drdy_sel bit");
+  return 0;
+}
+
+int nau7802_export_clock(i2c_master_dev_handle_t i2c, bool clock){
+  nau7802_state* ns = nau7802_config_lock(i2c);
+  if(!ns){
+    return -1;
+  }
+  int ret = nau7802_set_drdy_sel(i2c, clock);
+  nau7802_config_unlock(ns, false);
+  return ret;
+}
+
+#if SOC_PCNT_SUPPORTED
+// count rising edges on gpio for ms milliseconds using a PCNT unit, and
+// return the frequency in hz. the PCNT unit is only held for the duration.
+static int
+nau7802_count_edges(int gpio, unsigned ms, uint32_t* hz){
+  pcnt_unit_config_t ucfg = {
+    .low_limit = -1,
+    .high_limit = INT16_MAX,
+    .flags.accum_count = true,
+  };
+  pcnt_chan_config_t ccfg = {
+    .edge_gpio_num = gpio,
+    .level_gpio_num = -1,
+  };
+  pcnt_unit_handle_t unit = NULL;
+  pcnt_channel_handle_t chan = NULL;
+  int ret = -1;
+  esp_err_t e;
+  if((e = pcnt_new_unit(&ucfg, &unit)) != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) creating pcnt unit", esp_err_to_name(e));
+    return -1;
+  }
+  if((e = pcnt_new_channel(unit, &ccfg, &chan)) != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) creating pcnt channel on %d", esp_err_to_name(e), gpio);
+    goto done;
+  }
+  // accumulation across hardware overflows requires a watch point at the limit
+  if((e = pcnt_channel_set_edge_action(chan, PCNT_CHANNEL_EDGE_ACTION_INCREASE,
+                                       PCNT_CHANNEL_EDGE_ACTION_HOLD)) != ESP_OK ||
+     (e = pcnt_unit_add_watch_point(unit, INT16_MAX)) != ESP_OK ||
+     (e = pcnt_unit_enable(unit)) != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) configuring pcnt", esp_err_to_name(e));
+    goto done;
+  }
+  // keep us from being preempted between starting (stopping) the counter
+  // and taking the timestamp, which would skew the window.
+  int64_t t0 = 0;
+  if((e = pcnt_unit_clear_count(unit)) == ESP_OK){
+    vTaskSuspendAll();
+    e = pcnt_unit_start(unit);
+    t0 = esp_timer_get_time();
+    xTaskResumeAll();
+  }
+  if(e == ESP_OK){
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    vTaskSuspendAll();
+    e = pcnt_unit_stop(unit);
+    const int64_t elapsed = esp_timer_get_time() - t0;
+    xTaskResumeAll();
+    int count;
+    if(e == ESP_OK && (e = pcnt_unit_get_count(unit, &count)) == ESP_OK){
+      if(count > 0 && elapsed > 0){
+        *hz = (uint64_t)count * 1000000ull / elapsed;
+        ret = 0;
+      }else{
+        ESP_LOGE(TAG, "saw no edges on %d in %lldus", gpio, elapsed);
+      }
+    }
+  }
+  if(e != ESP_OK){
+    ESP_LOGE(TAG, "error (%s) counting edges", esp_err_to_name(e));
+  }
+  pcnt_unit_disable(unit);
+
+done:
+  if(chan){
+    pcnt_del_channel(chan);
+  }
+  pcnt_del_unit(unit);
+  return ret;
+}
+#endif
+
+int nau7802_measure_clock(i2c_master_dev_handle_t i2c, int drdy_gpio, unsigned ms){
+#if !SOC_PCNT_SUPPORTED
+  (void)i2c;
+  (void)drdy_gpio;
+  (void)ms;
+  ESP_LOGE(TAG, "no PCNT on this target, can't measure clock");
+  return -1;
+#else
+  // anything less than a tick wouldn't actually wait
+  if(ms < portTICK_PERIOD_MS || ms > 10000){
+    ESP_LOGE(TAG, "illegal measurement period %ums", ms);
+    return -1;
+  }
+  nau7802_state* ns = nau7802_state_get(i2c);
+  if(!ns){
+    return -1;
+  }
+  // conversions continue while the clock is exported, so exclude other
+  // configuration changes, but don't invalidate concurrent reads.
+  xSemaphoreTake(ns->lock, portMAX_DELAY);
+  uint32_t hz = 0;
+  int ret = nau7802_set_drdy_sel(i2c, true);
+  if(ret == 0){
+    ret = nau7802_count_edges(drdy_gpio, ms, &hz);
+    // always try to restore data readiness on DRDY
+    if(nau7802_set_drdy_sel(i2c, false)){
+      ret = -1;
+    }
+  }
+  const uint32_t tolerance = NOMINAL_CLOCK_HZ / 100 * CLOCK_TOLERANCE_PCT;
+  if(ret == 0 && (hz < NOMINAL_CLOCK_HZ - tolerance || hz > NOMINAL_CLOCK_HZ + tolerance)){
+    ESP_LOGE(TAG, "measured clock %luHz is implausible (nominal %luHz), ignoring",
+             hz, NOMINAL_CLOCK_HZ);
+    ret = -1;
+  }
+  if(ret == 0){
+    ns->clock_hz = hz;
+    nau7802_publish(ns);
+    ESP_LOGI(TAG, "measured clock %luHz (nominal %luHz), conversion period %lluns",
+             hz, NOMINAL_CLOCK_HZ, nau7802_period_ns(ns));
+  }
+  xSemaphoreGive(ns->lock);
+  return ret;
+#endif
+}
+
+int nau7802_conversion_period(i2c_master_dev_handle_t i2c, uint32_t* period){
+  const nau7802_state* ns = nau7802_state_find(i2c);
+  if(!ns){
+    // an unregistered handle has the default rate and the nominal clock
+    *period = 1000000000ul / rates[0];
+    return 0;
+  }
+  *period = atomic_load_explicit(&ns->period, memory_order_relaxed);
+  return 0;
+}